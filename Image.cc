@@ -16,28 +16,25 @@
 
 #include "Image.h"
 
-#include "pagespeed/kernel/image/image_util.h"
-#include "pagespeed/kernel/image/image_analysis.h"
-#include "pagespeed/kernel/base/stdio_file_system.h"
-#include "pagespeed/kernel/base/message_handler.h"
-#include "pagespeed/kernel/base/mock_message_handler.h"
-#include "pagespeed/kernel/base/null_mutex.h"
-#include "pagespeed/kernel/base/string_util.h"
-#include "pagespeed/kernel/base/string_writer.h"
-#include "net/instaweb/rewriter/public/image_data_lookup.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#ifndef IMGAT_SLIM
+#include "PagespeedAnalyzer.h"
+#endif
 #include "webp/decode.h"
-#include "pagespeed/kernel/image/scanline_utils.h"
 
 extern "C" {
 #include "gif_err.c"    
 }
 
-using namespace pagespeed::image_compression;
-
 namespace ImageHeaders {
 
 const char kPngHeader[] = "\x89PNG\r\n\x1a\n";
-const size_t kPngHeaderLength = STATIC_STRLEN(kPngHeader);
+const size_t kPngHeaderLength = sizeof(kPngHeader) - 1;
 const char kPngIHDR[] = "\0\0\0\x0dIHDR";
 const size_t kPngIntSize = 4;
 const size_t kPngSectionHeaderLength = 2 * kPngIntSize;
@@ -47,18 +44,278 @@ const size_t kPngColourTypeOffset = kIHDRDataStart + 2 * kPngIntSize + 1;
 const char kPngAlphaChannel = 0x4;  // bit of ColourType set for alpha channel
 const char kPngIDAT[] = "IDAT";
 const char kPngtRNS[] = "tRNS";
+const char kPnggAMA[] = "gAMA";
+const double kPngGammaScale = 100000.0;
+const double kPngsRGBGamma = 0.45455;
+const char kPngiCCP[] = "iCCP";
+const char kPngsRGB[] = "sRGB";
+const char kPngeXIf[] = "eXIf";
+const char kPngacTL[] = "acTL";
+const char kPngfcTL[] = "fcTL";
+const char kPngIEND[] = "IEND";
+const size_t kPngacTLLength = 2 * kPngIntSize;
+const size_t kPngfcTLLength = 26;
+const size_t kPngfcTLDelayOffset = 5 * kPngIntSize;
 
 const char kGifHeader[] = "GIF8";
-const size_t kGifHeaderLength = STATIC_STRLEN(kGifHeader);
+const size_t kGifHeaderLength = sizeof(kGifHeader) - 1;
 const size_t kGifDimStart = kGifHeaderLength + 2;
 const size_t kGifIntSize = 2;
+const size_t kGifPackedFieldsPos = kGifDimStart + 2 * kGifIntSize;
+const size_t kGifLogicalScreenEnd = kGifPackedFieldsPos + 3;
+const size_t kGifImageDescriptorLength = 9;
+const int kGifColorTableFlag = 0x80;  // bit of packed fields set for a colour table
+const int kGifExtensionIntroducer = 0x21;
+const int kGifImageSeparator = 0x2c;
+const int kGifTrailer = 0x3b;
+const int kGifGraphicControlLabel = 0xf9;
+const int kGifApplicationLabel = 0xff;
+const char kGifNetscapeApplication[] = "NETSCAPE2.0";
+const size_t kGifNetscapeApplicationLength = sizeof(kGifNetscapeApplication) - 1;
+
+const size_t kWebpHeaderLength = 12;
+const size_t kWebpChunkHeaderLength = 8;
+const size_t kWebpVP8XLength = 10;
+const size_t kWebpANIMLength = 6;
+const size_t kWebpANMFLength = 16;
+const size_t kWebpFirstChunkData = kWebpHeaderLength + kWebpChunkHeaderLength;
+const size_t kWebpVP8LHeaderLength = 5;
+const char kWebpAnimationFlag = 0x2;  // bit of VP8X flags set for animation
+const char kWebpAlphaFlag = 0x10;  // bit of VP8X flags set for alpha
+
+const char kJ2kCodestreamHeader[] = "\xff\x4f\xff\x51";  // SOC, SIZ
+const size_t kJ2kCodestreamHeaderLength = sizeof(kJ2kCodestreamHeader) - 1;
+const size_t kJ2kXsizOffset = kJ2kCodestreamHeaderLength + 4;
+const size_t kJ2kSsizOffset = kJ2kXsizOffset + 34;
+const size_t kJp2IhdrLength = 14;
+
+const int kJxrImageWidthTag = 0xbc80;
+const int kJxrImageHeightTag = 0xbc81;
+
+const int kTiffImageWidthTag = 0x100;
+const int kTiffImageLengthTag = 0x101;
+const int kTiffBitsPerSampleTag = 0x102;
+const size_t kIfdEntryLength = 12;
+const size_t kMaxIfdEntries = 1024;
+// Largest dimension that fits in the int width_ and height_ members.
+const uint32_t kMaxDimension = 0x7fffffff;
+
+const size_t kBmpInfoHeaderStart = 14;
+const uint32_t kBmpCoreHeaderLength = 12;
+const uint32_t kBmpInfoHeaderMinLength = 16;
+
+const int kExifOrientationTag = 0x112;
+const char kExifHeader[] = "Exif\0\0";
+const size_t kExifHeaderLength = 6;
+const char kIccProfileHeader[] = "ICC_PROFILE\0";
+const size_t kIccProfileHeaderLength = 12;
 
 const size_t kJpegIntSize = 2;
-const int64 kMaxJpegQuality = 100;
-const int64 kQualityForJpegWithUnkownQuality = 85;
+const int kJpegAPP1 = 0xe1;
+const int kJpegAPP2 = 0xe2;
+const int kJpegDQT = 0xdb;
+const int kJpegSOS = 0xda;
+const size_t kJpegSOFComponentsStart = kJpegIntSize + 1 + 2 * kJpegIntSize;
+const size_t kJpegSOFComponentLength = 3;
+
+// Luminance quantization table from Annex K of the JPEG standard, which
+// libjpeg scales by quality, in natural (row major) order.
+const int kJpegStdLuminanceTable[64] = {
+  16,  11,  10,  16,  24,  40,  51,  61,
+  12,  12,  14,  19,  26,  58,  60,  55,
+  14,  13,  16,  24,  40,  57,  69,  56,
+  14,  17,  22,  29,  51,  87,  80,  62,
+  18,  22,  37,  56,  68, 109, 103,  77,
+  24,  35,  55,  64,  81, 104, 113,  92,
+  49,  64,  78,  87, 103, 121, 120, 101,
+  72,  92,  95,  98, 112, 100, 103,  99
+};
+
+// Natural order position of each zig-zag ordered DQT entry.
+const int kJpegNaturalOrder[64] = {
+   0,  1,  8, 16,  9,  2,  3, 10,
+  17, 24, 32, 25, 18, 11,  4,  5,
+  12, 19, 26, 33, 40, 48, 41, 34,
+  27, 20, 13,  6,  7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36,
+  29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46,
+  53, 60, 61, 54, 47, 55, 62, 63
+};
+const int kMaxJpegQuality = 100;
+const int kQualityForJpegWithUnkownQuality = 85;
+
+// Magic bytes identifying an image format: |magic| at |offset|, and when
+// |magic2| is set, |magic2| at |offset2| as well.
+struct ImageSignature {
+  Format format;
+  size_t offset;
+  const char* magic;
+  size_t length;
+  size_t offset2;
+  const char* magic2;
+  size_t length2;
+};
+
+// Checked in order, so the formats we see most often come first.
+const ImageSignature kImageSignatures[] = {
+  { IMAGE_FORMAT_JPEG, 0, "\xff\xd8", 2, 0, NULL, 0 },
+  { IMAGE_FORMAT_PNG, 0, kPngHeader, kPngHeaderLength, 0, NULL, 0 },
+  { IMAGE_FORMAT_GIF, 0, "GIF89a", 6, 0, NULL, 0 },
+  { IMAGE_FORMAT_GIF, 0, "GIF87a", 6, 0, NULL, 0 },
+  { IMAGE_FORMAT_WEBP, 0, "RIFF", 4, 8, "WEBP", 4 },
+  { IMAGE_FORMAT_JP2K, 0, "\0\0\0\x0cjP  ", 8, 0, NULL, 0 },
+  { IMAGE_FORMAT_JP2K, 0, kJ2kCodestreamHeader, kJ2kCodestreamHeaderLength, 0, NULL, 0 },
+  { IMAGE_FORMAT_JXR, 0, "II\xbc\x01", 4, 0, NULL, 0 },
+  { IMAGE_FORMAT_TIFF, 0, "II*\0", 4, 0, NULL, 0 },
+  { IMAGE_FORMAT_TIFF, 0, "MM\0*", 4, 0, NULL, 0 },
+  { IMAGE_FORMAT_BMP, 0, "BM", 2, 0, NULL, 0 },
+};
+const size_t kImageSignatureCount = sizeof(kImageSignatures) / sizeof(kImageSignatures[0]);
 
 }  // namespace ImageHeaders
 
+static inline int CharToInt(char c) {
+  return static_cast<unsigned char>(c);
+}
+
+// Reads an unsigned big-endian integer of |bytes| length at |pos|.
+static uint32_t BigEndianIntAtPosition(const std::string& buf, size_t pos, int bytes) {
+  uint32_t value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    value = (value << 8) | CharToInt(buf[pos + i]);
+  }
+  return value;
+}
+
+// Reads an unsigned little-endian integer of |bytes| length at |pos|.
+static uint32_t LittleEndianIntAtPosition(const std::string& buf, size_t pos, int bytes) {
+  uint32_t value = 0;
+  for (int i = bytes - 1; i >= 0; --i) {
+    value = (value << 8) | CharToInt(buf[pos + i]);
+  }
+  return value;
+}
+
+static uint32_t IntAtPosition(const std::string& buf, size_t pos, int bytes, bool bigEndian) {
+  return bigEndian ? BigEndianIntAtPosition(buf, pos, bytes)
+                   : LittleEndianIntAtPosition(buf, pos, bytes);
+}
+
+static bool PngChunkIs(const char* type, const char* name) {
+  return memcmp(type, name, ImageHeaders::kPngIntSize) == 0;
+}
+
+// Reads the header of the png chunk at |*pos| and advances |*pos| past the
+// chunk's CRC. Returns false if the chunk is truncated.
+static bool NextPngChunk(const std::string& buf, size_t* pos, const char** type,
+                         size_t* data, uint32_t* length) {
+  if (*pos + ImageHeaders::kPngSectionHeaderLength > buf.size()) {
+    return false;
+  }
+  *length = BigEndianIntAtPosition(buf, *pos, ImageHeaders::kPngIntSize);
+  *type = buf.data() + *pos + ImageHeaders::kPngIntSize;
+  *data = *pos + ImageHeaders::kPngSectionHeaderLength;
+  if (*length > buf.size() - *data) {
+    return false;
+  }
+  *pos = *data + *length + ImageHeaders::kPngIntSize;
+  return true;
+}
+
+// Frame counts, loop counts and summed durations are read as unsigned values
+// but reported as int, so they are capped at INT_MAX rather than wrapping.
+static int ClampToInt(uint64_t value) {
+  return value > static_cast<uint64_t>(INT_MAX) ? INT_MAX : static_cast<int>(value);
+}
+
+// Returns the delay in milliseconds of the APNG fcTL chunk at |data|. The delay
+// is a fraction of a second, a zero denominator means 1/100.
+static int PngFrameDelay(const std::string& buf, size_t data) {
+  int delayNum = BigEndianIntAtPosition(buf, data + ImageHeaders::kPngfcTLDelayOffset, 2);
+  int delayDen = BigEndianIntAtPosition(buf, data + ImageHeaders::kPngfcTLDelayOffset + 2, 2);
+  if (delayDen == 0) delayDen = 100;
+  return delayNum * 1000 / delayDen;
+}
+
+static bool MatchesAtPosition(const std::string& buf, size_t pos, const char* magic, size_t length) {
+  return (pos + length <= buf.size() &&
+          memcmp(buf.data() + pos, magic, length) == 0);
+}
+
+// Looks for the first box of |type| between |start| and |end| of a JP2 file,
+// setting |dataStart| and |dataEnd| to the box contents.
+static bool FindJp2Box(const std::string& buf, size_t start, size_t end, const char* type,
+                       size_t* dataStart, size_t* dataEnd) {
+  size_t pos = start;
+  while (pos + 8 <= end) {
+    uint64_t length = BigEndianIntAtPosition(buf, pos, 4);
+    size_t header = 8;
+    if (length == 1) {  // 64 bit XLBox follows the type.
+      if (pos + 16 > end) return false;
+      length = (static_cast<uint64_t>(BigEndianIntAtPosition(buf, pos + 8, 4)) << 32) |
+               BigEndianIntAtPosition(buf, pos + 12, 4);
+      header = 16;
+    } else if (length == 0) {  // Box extends to the end.
+      length = end - pos;
+    }
+    if (length < header || length > end - pos) {
+      return false;
+    }
+    if (MatchesAtPosition(buf, pos + 4, type, 4)) {
+      *dataStart = pos + header;
+      *dataEnd = pos + length;
+      return true;
+    }
+    pos += length;
+  }
+  return false;
+}
+
+// Looks up |tag| in the TIFF style IFD at |ifd| of the |size| bytes of TIFF
+// data starting at |tiff|, and reads the first value of a BYTE, SHORT or
+// LONG entry. IFD offsets are relative to |tiff| and the entry count is
+// bounded, so a corrupted IFD can't make us scan far.
+static bool FindIfdValue(const std::string& buf, size_t tiff, size_t size, size_t ifd,
+                         bool bigEndian, int tag, uint32_t* value) {
+  if (ifd + 2 > size) {
+    return false;
+  }
+  size_t count = IntAtPosition(buf, tiff + ifd, 2, bigEndian);
+  if (count > ImageHeaders::kMaxIfdEntries) {
+    count = ImageHeaders::kMaxIfdEntries;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    size_t entry = ifd + 2 + i * ImageHeaders::kIfdEntryLength;
+    if (entry + ImageHeaders::kIfdEntryLength > size) {
+      return false;
+    }
+    int entryTag = IntAtPosition(buf, tiff + entry, 2, bigEndian);
+    if (entryTag != tag) {
+      continue;
+    }
+    int type = IntAtPosition(buf, tiff + entry + 2, 2, bigEndian);
+    uint32_t valueCount = IntAtPosition(buf, tiff + entry + 4, 4, bigEndian);
+    int valueSize;
+    switch (type) {
+      case 1: valueSize = 1; break;  // BYTE
+      case 3: valueSize = 2; break;  // SHORT
+      case 4: valueSize = 4; break;  // LONG
+      default: return false;
+    }
+    size_t pos = entry + 8;
+    if (valueCount > static_cast<uint32_t>(4 / valueSize)) {  // Values don't fit, entry holds an offset.
+      pos = IntAtPosition(buf, tiff + pos, 4, bigEndian);
+      if (pos + valueSize > size) {
+        return false;
+      }
+    }
+    *value = IntAtPosition(buf, tiff + pos, valueSize, bigEndian);
+    return true;
+  }
+  return false;
+}
+
 
 Image::Image(bool verbose) :
         verbose_(false),
@@ -72,7 +329,23 @@ Image::Image(bool verbose) :
         bitdepth_(0),
         colortype_(0),
         hasGamma_(false),
-        gamma_(.454545)
+        gamma_(.454545),
+        loopCount_(1),
+        duration_(0),
+        orientation_(1),
+        hasIccProfile_(false),
+        hasSrgb_(false),
+        quality_(0),
+        progressive_(false),
+        subsampling_("unknown"),
+        needsPagespeed_(false),
+        hasTrns_(false),
+        hasGifTransparency_(false),
+        transparencySource_(SOURCE_NONE),
+        photoSource_(SOURCE_NONE),
+        pngFrames_(0),
+        pngDuration_(0),
+        pngDataEnd_(0)
 {
     verbose_ = verbose;
 }
@@ -116,6 +389,30 @@ bool Image::hasGamma() {
 double Image::gamma() {
     return gamma_;
 }
+int Image::loopCount() {
+    return loopCount_;
+}
+int Image::duration() {
+    return duration_;
+}
+int Image::orientation() {
+    return orientation_;
+}
+bool Image::hasIccProfile() {
+    return hasIccProfile_;
+}
+bool Image::hasSrgb() {
+    return hasSrgb_;
+}
+int Image::quality() {
+    return quality_;
+}
+bool Image::isProgressive() {
+    return progressive_;
+}
+const char* Image::subsampling() {
+    return subsampling_;
+}
 
 
 const char* Image::imageFormatAsString(){
@@ -128,84 +425,243 @@ const char* Image::imageFormatAsString(){
         case IMAGE_FORMAT_GIF: return "GIF";
         case IMAGE_FORMAT_PNG: return "PNG";
         case IMAGE_FORMAT_WEBP: return "WEBP";
+        case IMAGE_FORMAT_TIFF: return "TIFF";
+        case IMAGE_FORMAT_BMP: return "BMP";
         default: return "UNKNOWN";
     }
   
 }
 
-ImageFormat Image::getGoogleImageFormat()
-{
-    switch(imageFormat_)
-    {
-        case IMAGE_FORMAT_JPEG: return IMAGE_JPEG;
-        case IMAGE_FORMAT_GIF: return IMAGE_GIF;
-        case IMAGE_FORMAT_PNG: return IMAGE_PNG;
-        case IMAGE_FORMAT_WEBP: return IMAGE_WEBP;
-        default: return IMAGE_UNKNOWN;
-    }
+bool Image::needsPagespeed() {
+    return needsPagespeed_;
+}
+
+// Formats the pagespeed image analysis is able to decode.
+static bool IsPagespeedFormat(Format format) {
+    return (format == IMAGE_FORMAT_JPEG || format == IMAGE_FORMAT_PNG
+            || format == IMAGE_FORMAT_GIF || format == IMAGE_FORMAT_WEBP);
 }
 
 
-bool Image::readFile(const GoogleString& file_name) {
+bool Image::readFile(const std::string& file_name) {
     filename_.append(file_name);
-    net_instaweb::StdioFileSystem file_system;
-    net_instaweb::StringWriter writer(&content_);
-    net_instaweb::MockMessageHandler messageHandler(new net_instaweb::NullMutex);
-    return(file_system.ReadFile(filename_.c_str(), &writer, &messageHandler));
+    FILE* fp = fopen(filename_.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    char buffer[64 * 1024];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        content_.append(buffer, read);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
 }
 
 
 
-bool Image::analyze(bool checkTransparency, bool checkAnimated, bool checkPhoto, bool checkExtended) {
+static double NowMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
 
-    net_instaweb::MockMessageHandler messageHandler(new net_instaweb::NullMutex);
-    
+static const char* SourceAsString(PropertySource source) {
+    switch(source)
+    {
+        case SOURCE_HEADER: return "header";
+        case SOURCE_CHUNK: return "chunk";
+        case SOURCE_PARTIAL_DECODE: return "partial-decode";
+        case SOURCE_FULL_DECODE: return "full-decode";
+        default: return "none";
+    }
+}
+
+// Plans the analysis. Each requested property is answered from the cheapest
+// source that can answer it for this format: a header fact, a chunk/box/block
+// flag, a partial decode (libgif) and only then the full pagespeed decode,
+// which is shared when more than one property needs it. Only the header and
+// chunk sources are read here; needsPagespeed() tells whether analyze() will
+// need the full decode.
+bool Image::plan(bool checkTransparency, bool checkAnimated, bool checkPhoto, bool checkExtended) {
+
+    double start = NowMs();
     ComputeImageType();
     if(imageFormat_ == IMAGE_FORMAT_UNKNOWN) {
         fprintf(stderr, "Unknown Image Format.\n");
         return false;   
     }
-    
-    if(imageFormat_ == IMAGE_FORMAT_GIF && (checkTransparency || checkAnimated)) {
-        if(!FindGifDetails(checkTransparency))
-        {
-            fprintf(stderr, "Failed to find GIF details.\n");
+    if(verbose_) fprintf(stdout, "plan: header pass took %.3f ms\n", NowMs() - start);
+
+    // Animated images are never decoded, so transparency and photo need to
+    // know about animation too.
+    PropertySource animatedSource = SOURCE_NONE;
+    if(checkAnimated || checkTransparency || checkPhoto) {
+        start = NowMs();
+        if(!PlanAnimated(&animatedSource)) {
             return false;
         }
+        if(verbose_) fprintf(stdout, "plan: animated from %s took %.3f ms\n",
+                             SourceAsString(animatedSource), NowMs() - start);
+    }
+    if(checkTransparency) {
+        transparencySource_ = PlanTransparency();
+    }
+    if(checkPhoto) {
+        photoSource_ = PlanPhoto();
     }
-    if(imageFormat_ == IMAGE_FORMAT_PNG && checkExtended) {
-        if(!FindPngDetails()){
-            fprintf(stderr, "Failed to find PNG details.\n");
+    needsPagespeed_ = (transparencySource_ == SOURCE_FULL_DECODE || photoSource_ == SOURCE_FULL_DECODE);
+    if(verbose_) fprintf(stdout, "plan: transparency=%s photo=%s extended=%s\n",
+                         SourceAsString(transparencySource_), SourceAsString(photoSource_),
+                         SourceAsString(checkExtended ? SOURCE_HEADER : SOURCE_NONE));
+    return true;
+}
+
+// Runs the decode stages plan() left for the properties it couldn't answer.
+// The slim build can't run the full decode, so it gives up before decoding
+// anything and leaves it to the caller to hand the image over.
+bool Image::analyze() {
+    double start;
+#ifdef IMGAT_SLIM
+    if(needsPagespeed_) {
+        if(verbose_) fprintf(stdout, "pagespeed: not available in this build\n");
+        return false;
+    }
+#endif
+
+    if(transparencySource_ == SOURCE_PARTIAL_DECODE) {
+        start = NowMs();
+        if(!FindGifDetails(true))
+        {
+            fprintf(stderr, "Failed to find GIF details.\n");
             return false;
         }
-            
+        if(verbose_) fprintf(stdout, "plan: partial decode took %.3f ms\n", NowMs() - start);
     }
-        
-    if(!isAnimated_ && (checkTransparency || checkPhoto)
-            && imageFormat_ != IMAGE_FORMAT_JP2K
-            && imageFormat_ != IMAGE_FORMAT_JXR) {
+
+#ifndef IMGAT_SLIM
+    if(needsPagespeed_) {
+        start = NowMs();
+        bool hasTransparency = false, isPhoto = false;
         if(verbose_) fprintf(stdout, "pagespeed: analyzing image\n"); 
-        if(AnalyzeImage(getGoogleImageFormat(), content_.data(),
-                            content_.length(), &messageHandler,
-                            &hasTransparency_, &isPhoto_)) {
-            if(verbose_) fprintf(stdout, "pagespeed: HasTransparency=%i\n", hasTransparency_); 
-            if(verbose_) fprintf(stdout, "pagespeed: IsPhoto=%i\n", isPhoto_);  
+        if(PagespeedAnalyzeImage(imageFormat_, content_, &hasTransparency, &isPhoto)) {
+            if(transparencySource_ == SOURCE_FULL_DECODE) hasTransparency_ = hasTransparency;
+            if(photoSource_ == SOURCE_FULL_DECODE) isPhoto_ = isPhoto;
+            if(verbose_) fprintf(stdout, "pagespeed: HasTransparency=%i\n", hasTransparency); 
+            if(verbose_) fprintf(stdout, "pagespeed: IsPhoto=%i\n", isPhoto);  
         } else {
             return false;
         }
+        if(verbose_) fprintf(stdout, "plan: full decode took %.3f ms\n", NowMs() - start);
     }
+#endif
+    return true;
+}
+
+// Animation can only come from the GIF blocks, the APNG chunks or the
+// extended WebP chunks; every other format is a still image.
+bool Image::PlanAnimated(PropertySource* source) {
+    switch(imageFormat_)
+    {
+        case IMAGE_FORMAT_GIF:
+            if(!FindGifFrames()) {
+                fprintf(stderr, "Failed to find GIF frames.\n");
+                return false;
+            }
+            *source = SOURCE_CHUNK;
+            break;
+        case IMAGE_FORMAT_PNG:
+            FindPngAnimation();
+            *source = SOURCE_CHUNK;
+            break;
+        case IMAGE_FORMAT_WEBP:
+            FindWebpAnimation();
+            *source = MatchesAtPosition(content_, ImageHeaders::kWebpHeaderLength, "VP8X", 4)
+                    ? SOURCE_CHUNK : SOURCE_HEADER;
+            break;
+        default:
+            *source = SOURCE_HEADER;
+            break;
+    }
+    return true;
+}
+
+PropertySource Image::PlanTransparency() {
+    const std::string& buf = content_;
+    if(IsPagespeedFormat(imageFormat_) && (width_ <= 0 || height_ <= 0)) {
+        // The header didn't parse, so nothing read from it can be trusted;
+        // leave it to the decode, which reports the corrupt file.
+        return SOURCE_FULL_DECODE;
+    }
+    switch(imageFormat_)
+    {
+        case IMAGE_FORMAT_JPEG:
+            return SOURCE_HEADER;  // JPEG has no alpha.
+        case IMAGE_FORMAT_PNG:
+            if(!(colortype_ & ImageHeaders::kPngAlphaChannel) && !hasTrns_) {
+                return SOURCE_HEADER;
+            }
+            if(isAnimated_) {
+                // Frames aren't decoded, go by the alpha channel or tRNS chunk.
+                hasTransparency_ = true;
+                return SOURCE_HEADER;
+            }
+            return SOURCE_FULL_DECODE;
+        case IMAGE_FORMAT_WEBP:
+            // The VP8X alpha flag is set when any frame has alpha, simple
+            // lossless images carry an alpha_is_used bit in the VP8L header
+            // and simple lossy images can't have alpha.
+            if(buf.size() < ImageHeaders::kWebpHeaderLength + ImageHeaders::kWebpChunkHeaderLength
+                    + ImageHeaders::kWebpVP8LHeaderLength) {
+                return SOURCE_FULL_DECODE;
+            }
+            if(MatchesAtPosition(buf, ImageHeaders::kWebpHeaderLength, "VP8X", 4)) {
+                hasTransparency_ = (buf[ImageHeaders::kWebpFirstChunkData] & ImageHeaders::kWebpAlphaFlag) != 0;
+                return SOURCE_CHUNK;
+            }
+            if(MatchesAtPosition(buf, ImageHeaders::kWebpHeaderLength, "VP8L", 4)) {
+                uint32_t bits = LittleEndianIntAtPosition(buf, ImageHeaders::kWebpFirstChunkData + 1, 4);
+                hasTransparency_ = ((bits >> 28) & 1) != 0;
+                return SOURCE_HEADER;
+            }
+            if(MatchesAtPosition(buf, ImageHeaders::kWebpHeaderLength, "VP8 ", 4)) {
+                return SOURCE_HEADER;
+            }
+            return SOURCE_FULL_DECODE;
+        case IMAGE_FORMAT_GIF:
+            // Without a transparent colour index in any graphic control
+            // extension nothing can be transparent, otherwise libgif has to
+            // check the index is actually used. This holds even when -p runs
+            // the pagespeed decode, so -t answers the same with or without it.
+            return hasGifTransparency_ ? SOURCE_PARTIAL_DECODE : SOURCE_CHUNK;
+        default:
+            return SOURCE_NONE;
+    }
+}
+
+// Only the pagespeed analysis can tell photos apart, and it isn't run on
+// animated images.
+PropertySource Image::PlanPhoto() {
+    if(isAnimated_ || !IsPagespeedFormat(imageFormat_)) {
+        return SOURCE_NONE;
+    }
+    return SOURCE_FULL_DECODE;
 }
 
 
 
 // Gif handling with GifLib
+struct GifStreamInput {
+  const std::string* data;
+  size_t offset;
+};
+
 int ReadGifFromStream(GifFileType* gif_file, GifByteType* data, int length) {
-  pagespeed::image_compression::ScanlineStreamInput* input =
-    static_cast<pagespeed::image_compression::ScanlineStreamInput*>(
-      gif_file->UserData);
-  if (input->offset() + length <= input->length()) {
-    memcpy(data, input->data() + input->offset(), length);
-    input->set_offset(input->offset() + length);
+  GifStreamInput* input = static_cast<GifStreamInput*>(gif_file->UserData);
+  if (input->offset + length <= input->data->size()) {
+    memcpy(data, input->data->data() + input->offset, length);
+    input->offset += length;
     return length;
   } else {
     fprintf(stderr, "Unexpected EOF.\n");
@@ -215,8 +671,7 @@ int ReadGifFromStream(GifFileType* gif_file, GifByteType* data, int length) {
 
 bool Image::FindGifDetails(bool checkTransparency) {
     if(verbose_) fprintf(stdout, "libgif: analyzing gif image\n"); 
-    ScanlineStreamInput input(NULL);
-    input.Initialize(content_);
+    GifStreamInput input = { &content_, 0 };
     GifFileType* gif = DGifOpen(&input, ReadGifFromStream, NULL);
     if (!gif) {
         fprintf(stderr, "Failed to get image descriptor.\n");
@@ -277,81 +732,6 @@ bool Image::CheckTranparentColorUsed(const GifFileType* gif, int transparentColo
     return false;
 }
 
-//PNG handling with libpng
-bool Image::FindPngDetails() {
-    const StringPiece& buf = content_;
-  
-    png_structp png_ptr;
-    png_infop info_ptr;
-    
-
-    if ((buf.size() > 0)) {// Not truncated
-        FILE *fp = fopen(filename_.c_str(), "rb");
-        if (!fp) {
-           fprintf(stderr, "FindPngDetails File %s could not be opened for reading\n", filename_.c_str());
-           return false;
-        }
-        
-        char header[8];
-        fread(header, 1, 8, fp);
-       
-        if (png_sig_cmp(reinterpret_cast<png_const_bytep>(header), 0, 8)) {
-            fprintf(stderr, "FindPngDetails Did not recognize file has a PNG\n");
-            fclose(fp);
-            return false;
-        }
-       
-       /* initialize stuff */
-        png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-        if (!png_ptr) {
-            fprintf(stderr, "FindPngDetails png_create_read_struct failed\n");
-            png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-            fclose(fp);
-            return false;
-        }
-
-        info_ptr = png_create_info_struct(png_ptr);
-        if (!info_ptr) {
-            fprintf(stderr, "FindPngDetails png_create_info_struct failed\n");
-            png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-            fclose(fp);
-            return false;
-        }
-
-        if(verbose_) fprintf(stdout, "libpng: init\n");
-        
-        if (setjmp(png_jmpbuf(png_ptr))) {
-            
-            fprintf(stderr, "FindPngDetails setjmp Error\n");
-            png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-            fclose(fp);
-            return false;
-        }
-        
-        if(verbose_) fprintf(stdout, "libpng: Reading in PNG\n");
-        png_init_io(png_ptr, fp);
-        png_set_sig_bytes(png_ptr, 8);
-        png_read_info(png_ptr, info_ptr);
-        
-        if(!png_get_gAMA(png_ptr, info_ptr, &gamma_)){
-            if(verbose_) fprintf(stdout, "libpng: Gamma was not found in PNG, using default value.\n");
-            gamma_ = .454545;
-        } else {
-            if(verbose_) fprintf(stdout, "libpng: Gamma was found in PNG.\n");
-            hasGamma_ = true;
-        }
-            
-        fclose(fp);
-        return true;
-    } else {
-      fprintf(stderr, "Couldn't find png details (data truncated or IHDR missing).\n");
-      return false;
-    }
-}
-
-    
-
 //From modpagespeed ImageImpl Class
 //Code below this point is adapted from 
 //https://code.google.com/p/modpagespeed/source/browse/trunk/src/net/instaweb/rewriter/image.cc
@@ -361,11 +741,11 @@ bool Image::FindPngDetails() {
 // Loosely based on code and FAQs found here:
 //    http://www.faqs.org/faqs/jpeg-faq/part1/
 void Image::FindJpegSize() {
-  const StringPiece& buf = content_;
+  const std::string& buf = content_;
   size_t pos = 2;  // Position of first data block after header.
   while (pos < buf.size()) {
     // Read block identifier
-    int id = net_instaweb::CharToInt(buf[pos++]);
+    int id = CharToInt(buf[pos++]);
     if (id == 0xff) {  // Padding byte
       continue;
     }
@@ -375,7 +755,27 @@ void Image::FindJpegSize() {
     if (pos + ImageHeaders::kJpegIntSize > buf.size()) {
       break;
     }
-    int length = net_instaweb::JpegIntAtPosition(buf, pos);
+    int length = BigEndianIntAtPosition(buf, pos, ImageHeaders::kJpegIntSize);
+    // APP1 and APP2 segments ahead of the SOFn header carry the EXIF
+    // orientation and the ICC profile.
+    if (id == ImageHeaders::kJpegAPP1 &&
+        MatchesAtPosition(buf, pos + ImageHeaders::kJpegIntSize,
+                          ImageHeaders::kExifHeader, ImageHeaders::kExifHeaderLength)) {
+      size_t tiff = pos + ImageHeaders::kJpegIntSize + ImageHeaders::kExifHeaderLength;
+      size_t end = std::min(pos + length, buf.size());
+      if (tiff < end) {
+        FindExifOrientation(tiff, end - tiff);
+      }
+    } else if (id == ImageHeaders::kJpegAPP2 &&
+               MatchesAtPosition(buf, pos + ImageHeaders::kJpegIntSize,
+                                 ImageHeaders::kIccProfileHeader,
+                                 ImageHeaders::kIccProfileHeaderLength)) {
+      hasIccProfile_ = true;
+    } else if (id == ImageHeaders::kJpegDQT) {
+      FindJpegQuality(pos, length);
+    } else if (id == ImageHeaders::kJpegSOS) {
+      break;  // Entropy coded image data follows.
+    }
     // Now check for a SOFn header, which describes image dimensions.
     if (0xc0 <= id && id <= 0xcf &&  // SOFn header
         length >= 8 &&               // Valid SOFn block size
@@ -387,13 +787,16 @@ void Image::FindJpegSize() {
       // just that we can fetch both dimensions without trouble.
       // Our image download could be truncated at this point for
       // all we care.
-      // We're a bit sloppy about SOFn block size, as it's
-      // actually 8 + 3 * buf[pos+2], but for our purposes this
-      // will suffice as we don't parse subsequent metadata (which
-      // describes the formatting of chunks of image data).
-      height_ = net_instaweb::JpegIntAtPosition(buf, pos + 1 + ImageHeaders::kJpegIntSize);
-      width_  = net_instaweb::JpegIntAtPosition(buf, pos + 1 + 2 * ImageHeaders::kJpegIntSize);
-      break;
+      // The component sampling factors following the dimensions
+      // are only read when they weren't truncated.
+      height_ = BigEndianIntAtPosition(buf, pos + 1 + ImageHeaders::kJpegIntSize, ImageHeaders::kJpegIntSize);
+      width_  = BigEndianIntAtPosition(buf, pos + 1 + 2 * ImageHeaders::kJpegIntSize, ImageHeaders::kJpegIntSize);
+      FindJpegFrameDetails(id, pos);
+      // Tables are normally written ahead of the frame header, keep looking
+      // up to the first scan only if we haven't seen the luminance table.
+      if (quality_ > 0) {
+        break;
+      }
     }
     pos += length;
   }
@@ -404,49 +807,329 @@ void Image::FindJpegSize() {
   }
 }
 
+// Looks at the SOFn segment at |pos| for the frame type and the sampling
+// factors of the components to work out the chroma subsampling.
+void Image::FindJpegFrameDetails(int id, size_t pos) {
+  const std::string& buf = content_;
+  progressive_ = (id == 0xc2 || id == 0xc6 || id == 0xca || id == 0xce);
+  size_t components = pos + ImageHeaders::kJpegSOFComponentsStart;
+  if (components >= buf.size()) {
+    return;
+  }
+  int numComponents = CharToInt(buf[components]);
+  if (numComponents == 1) {
+    subsampling_ = "gray";
+  } else if (numComponents >= 3 &&
+             components + 1 + 3 * ImageHeaders::kJpegSOFComponentLength <= buf.size()) {
+    // Luma sampling factors relative to the (matching) chroma ones.
+    int luma = CharToInt(buf[components + 2]);
+    int cb = CharToInt(buf[components + 2 + ImageHeaders::kJpegSOFComponentLength]);
+    int cr = CharToInt(buf[components + 2 + 2 * ImageHeaders::kJpegSOFComponentLength]);
+    int h = luma >> 4, v = luma & 0x0f;
+    int ch = cb >> 4, cv = cb & 0x0f;
+    subsampling_ = "other";
+    if (cb == cr && ch > 0 && cv > 0 && h % ch == 0 && v % cv == 0) {
+      h /= ch;
+      v /= cv;
+      if (h == 1 && v == 1) subsampling_ = "4:4:4";
+      else if (h == 2 && v == 1) subsampling_ = "4:2:2";
+      else if (h == 2 && v == 2) subsampling_ = "4:2:0";
+      else if (h == 1 && v == 2) subsampling_ = "4:4:0";
+      else if (h == 4 && v == 1) subsampling_ = "4:1:1";
+      else if (h == 4 && v == 2) subsampling_ = "4:1:0";
+    }
+  }
+  if(verbose_) fprintf(stdout, "jpeg: Progressive=%i Subsampling=%s\n", progressive_, subsampling_);
+}
+
+// Estimates the IJG (libjpeg) quality setting from the luminance table of
+// the DQT segment at |pos|. libjpeg scales the standard table by 5000 / q
+// below quality 50 and by 200 - 2q above it, so averaging the ratio of each
+// entry to the standard one and inverting that scaling gets us back to q.
+void Image::FindJpegQuality(size_t pos, int length) {
+  const std::string& buf = content_;
+  size_t end = std::min(pos + length, buf.size());
+  pos += ImageHeaders::kJpegIntSize;
+  while (pos < end) {
+    int info = CharToInt(buf[pos++]);
+    int precision = (info >> 4) ? 2 : 1;
+    if (pos + 64 * precision > end) {
+      return;
+    }
+    if ((info & 0x0f) == 0) {
+      // Entries libjpeg clamped to 1 or 255 would skew the average.
+      double scale = 0;
+      int count = 0, clampedHigh = 0;
+      for (int i = 0; i < 64; ++i) {
+        int value = BigEndianIntAtPosition(buf, pos + i * precision, precision);
+        if (value <= 1 || (precision == 1 && value >= 255)) {
+          if (value > 1) clampedHigh++;
+          continue;
+        }
+        scale += value * 100.0 /
+            ImageHeaders::kJpegStdLuminanceTable[ImageHeaders::kJpegNaturalOrder[i]];
+        count++;
+      }
+      int quality;
+      if (count == 0) {
+        quality = (clampedHigh > 0) ? 1 : ImageHeaders::kMaxJpegQuality;
+      } else {
+        scale /= count;
+        quality = static_cast<int>((scale <= 100 ? (200 - scale) / 2 : 5000 / scale) + 0.5);
+      }
+      quality_ = std::max(1, std::min(quality, static_cast<int>(ImageHeaders::kMaxJpegQuality)));
+      if(verbose_) fprintf(stdout, "jpeg: Quality=%i\n", quality_);
+      return;
+    }
+    pos += 64 * precision;
+  }
+}
+
 // Looks at first (IHDR) block of png stream to find image dimensions.
 // See also: http://www.w3.org/TR/PNG/
 void Image::FindPngSize() {
-  const StringPiece& buf = content_;
+  const std::string& buf = content_;
   // Here we make sure that buf contains at least enough data that we'll be able
   // to decipher the image dimensions first, before we actually check for the
   // headers and attempt to decode the dimensions (which are the first two ints
-  // after the IHDR section label).
+  // after the IHDR section label) and the bit depth and colour type bytes.
   if ((buf.size() >=  // Not truncated
-       ImageHeaders::kIHDRDataStart + 2 * ImageHeaders::kPngIntSize) &&
-      (StringPiece(buf.data() + ImageHeaders::kPngHeaderLength,
-                   ImageHeaders::kPngSectionHeaderLength) ==
-       StringPiece(ImageHeaders::kPngIHDR,
-                   ImageHeaders::kPngSectionHeaderLength))) {
-    width_ = net_instaweb::PngIntAtPosition(buf, ImageHeaders::kIHDRDataStart);
-    height_ = net_instaweb::PngIntAtPosition(buf, ImageHeaders::kIHDRDataStart + ImageHeaders::kPngIntSize);
-    bitdepth_ = net_instaweb::CharToInt(buf[ImageHeaders::kIHDRDataStart + (2 * ImageHeaders::kPngIntSize)]);
-    colortype_ = net_instaweb::CharToInt(buf[ImageHeaders::kIHDRDataStart + (2 * ImageHeaders::kPngIntSize) + 1]);
+       ImageHeaders::kIHDRDataStart + 2 * ImageHeaders::kPngIntSize + 2) &&
+      MatchesAtPosition(buf, ImageHeaders::kPngHeaderLength, ImageHeaders::kPngIHDR,
+                        ImageHeaders::kPngSectionHeaderLength)) {
+    width_ = BigEndianIntAtPosition(buf, ImageHeaders::kIHDRDataStart, ImageHeaders::kPngIntSize);
+    height_ = BigEndianIntAtPosition(buf, ImageHeaders::kIHDRDataStart + ImageHeaders::kPngIntSize,
+                                     ImageHeaders::kPngIntSize);
+    bitdepth_ = CharToInt(buf[ImageHeaders::kIHDRDataStart + (2 * ImageHeaders::kPngIntSize)]);
+    colortype_ = CharToInt(buf[ImageHeaders::kIHDRDataStart + (2 * ImageHeaders::kPngIntSize) + 1]);
+    FindPngMetadata();
   } else {
     fprintf(stderr, "Couldn't find png dimensions (data truncated or IHDR missing).");
   }
 }
+
+// Walks the png chunks between IHDR and the first IDAT for the gAMA, iCCP,
+// sRGB, eXIf and tRNS chunks, all of which have to appear before the image
+// data. The APNG acTL chunk and the first fcTL come before it too, so they are
+// recorded here and FindPngAnimation picks up after the first IDAT.
+void Image::FindPngMetadata() {
+  const std::string& buf = content_;
+  size_t pos = ImageHeaders::kPngHeaderLength;
+  bool foundGamma = false;
+  const char* type;
+  size_t data;
+  uint32_t length;
+  pngDataEnd_ = buf.size();
+  while (NextPngChunk(buf, &pos, &type, &data, &length)) {
+    if (PngChunkIs(type, ImageHeaders::kPngIDAT)) {
+      pngDataEnd_ = pos;
+      break;
+    }
+    if (PngChunkIs(type, ImageHeaders::kPnggAMA) && length >= ImageHeaders::kPngIntSize) {
+      uint32_t gamma = BigEndianIntAtPosition(buf, data, ImageHeaders::kPngIntSize);
+      if (gamma > 0) {
+        gamma_ = gamma / ImageHeaders::kPngGammaScale;
+        foundGamma = true;
+      }
+    } else if (PngChunkIs(type, ImageHeaders::kPngtRNS)) {
+      hasTrns_ = true;
+    } else if (PngChunkIs(type, ImageHeaders::kPngiCCP)) {
+      hasIccProfile_ = true;
+    } else if (PngChunkIs(type, ImageHeaders::kPngsRGB)) {
+      hasSrgb_ = true;
+    } else if (PngChunkIs(type, ImageHeaders::kPngeXIf)) {
+      FindExifOrientation(data, length);
+    } else if (PngChunkIs(type, ImageHeaders::kPngacTL) && length >= ImageHeaders::kPngacTLLength) {
+      pngFrames_ = ClampToInt(BigEndianIntAtPosition(buf, data, ImageHeaders::kPngIntSize));
+      loopCount_ = ClampToInt(BigEndianIntAtPosition(buf, data + ImageHeaders::kPngIntSize,
+                                                     ImageHeaders::kPngIntSize));
+    } else if (PngChunkIs(type, ImageHeaders::kPngfcTL) && length >= ImageHeaders::kPngfcTLLength) {
+      pngDuration_ += PngFrameDelay(buf, data);
+    }
+  }
+  // Like libpng, an sRGB chunk without gAMA implies the sRGB gamma.
+  if (!foundGamma && hasSrgb_) {
+    gamma_ = ImageHeaders::kPngsRGBGamma;
+    foundGamma = true;
+  }
+  hasGamma_ = foundGamma;
+  if(verbose_) fprintf(stdout, "png: HasGamma=%i Gamma=%f\n", hasGamma_, gamma_);
+  if(verbose_) fprintf(stdout, "png: HasIccProfile=%i HasSrgb=%i Orientation=%i\n",
+                       hasIccProfile_, hasSrgb_, orientation_);
+}
+
+// Reads the Orientation tag from IFD0 of the |size| bytes of EXIF data at
+// |tiff|, which start with a TIFF header. Only IFD0 is looked at and its entry
+// count is bounded, so corrupted EXIF data can't cause a long scan.
+void Image::FindExifOrientation(size_t tiff, size_t size) {
+  const std::string& buf = content_;
+  if (size < 8) {
+    return;
+  }
+  bool bigEndian;
+  if (MatchesAtPosition(buf, tiff, "MM\0*", 4)) {
+    bigEndian = true;
+  } else if (MatchesAtPosition(buf, tiff, "II*\0", 4)) {
+    bigEndian = false;
+  } else {
+    return;
+  }
+  uint32_t ifd = IntAtPosition(buf, tiff + 4, 4, bigEndian);
+  uint32_t orientation = 0;
+  if (FindIfdValue(buf, tiff, size, ifd, bigEndian, ImageHeaders::kExifOrientationTag, &orientation) &&
+      orientation >= 1 && orientation <= 8) {
+    orientation_ = orientation;
+    if(verbose_) fprintf(stdout, "exif: Orientation=%i\n", orientation_);
+  }
+}
   
+// Finishes the APNG walk FindPngMetadata started: when it found an acTL
+// (animation control) chunk, the chunks after the first IDAT are walked for
+// the remaining fcTL (frame control) chunks. Chunk data is skipped by its
+// length, so no image data is inflated.
+// See also: https://wiki.mozilla.org/APNG_Specification
+void Image::FindPngAnimation() {
+  if (pngFrames_ <= 0) {
+    return;
+  }
+  const std::string& buf = content_;
+  size_t pos = pngDataEnd_;
+  const char* type;
+  size_t data;
+  uint32_t length;
+  while (NextPngChunk(buf, &pos, &type, &data, &length)) {
+    if (PngChunkIs(type, ImageHeaders::kPngfcTL) && length >= ImageHeaders::kPngfcTLLength) {
+      pngDuration_ += PngFrameDelay(buf, data);
+    } else if (PngChunkIs(type, ImageHeaders::kPngIEND)) {
+      break;
+    }
+  }
+  frames_ = pngFrames_;
+  duration_ = ClampToInt(pngDuration_);
+  isAnimated_ = (pngFrames_ > 1);
+  if(verbose_) fprintf(stdout, "png: Frames=%i\n", frames_);
+  if(verbose_) fprintf(stdout, "png: Loops=%i\n", loopCount_);
+  if(verbose_) fprintf(stdout, "png: Duration=%i\n", duration_);
+}
 
 
 // Looks at header of GIF file to extract image dimensions.
 // See also: http://en.wikipedia.org/wiki/Graphics_Interchange_Format
 void Image::FindGifSize() {
-  const StringPiece& buf = content_;
+  const std::string& buf = content_;
   // Make sure that buf contains enough data that we'll be able to
   // decipher the image dimensions before we attempt to do so.
   if (buf.size() >= ImageHeaders::kGifDimStart + 2 * ImageHeaders::kGifIntSize) {
     // Not truncated
-    width_ = net_instaweb::GifIntAtPosition(buf, ImageHeaders::kGifDimStart);
-    height_ = net_instaweb::GifIntAtPosition(
-        buf, ImageHeaders::kGifDimStart + ImageHeaders::kGifIntSize);
+    width_ = LittleEndianIntAtPosition(buf, ImageHeaders::kGifDimStart, ImageHeaders::kGifIntSize);
+    height_ = LittleEndianIntAtPosition(
+        buf, ImageHeaders::kGifDimStart + ImageHeaders::kGifIntSize, ImageHeaders::kGifIntSize);
   } else {
     fprintf(stderr, "Couldn't find gif dimensions (data truncated)");
   }
 }
 
+// Returns the position just past the sub-block terminator of the data
+// sub-blocks starting at |pos|, or a position past the end of |buf| if the
+// data was truncated.
+static size_t SkipGifSubBlocks(const std::string& buf, size_t pos) {
+  while (pos < buf.size()) {
+    int length = CharToInt(buf[pos++]);
+    if (length == 0) {
+      return pos;
+    }
+    pos += length;
+  }
+  return buf.size() + 1;
+}
+
+// Walks the blocks of a gif stream to count the frames, reading the graphic
+// control extension delays and the NETSCAPE2.0 loop count on the way. Image
+// data sub-blocks are skipped by their length bytes, so nothing is LZW
+// decoded.
+// See also: http://www.w3.org/Graphics/GIF/spec-gif89a.txt
+bool Image::FindGifFrames() {
+  const std::string& buf = content_;
+  if (buf.size() < ImageHeaders::kGifLogicalScreenEnd) {
+    fprintf(stderr, "Couldn't find gif frames (data truncated).\n");
+    return false;
+  }
+  if(verbose_) fprintf(stdout, "gif: walking gif blocks\n");
+  size_t pos = ImageHeaders::kGifLogicalScreenEnd;
+  int packed = CharToInt(buf[ImageHeaders::kGifPackedFieldsPos]);
+  if (packed & ImageHeaders::kGifColorTableFlag) {
+    pos += 3 * (1 << ((packed & 0x07) + 1));  // Global colour table.
+  }
+  int numFrames = 0;
+  uint64_t duration = 0;
+  int delay = 0;
+  int disposal = 0;
+  while (pos < buf.size()) {
+    int id = CharToInt(buf[pos++]);
+    if (id == ImageHeaders::kGifTrailer) {
+      break;
+    } else if (id == ImageHeaders::kGifExtensionIntroducer) {
+      if (pos >= buf.size()) {
+        break;
+      }
+      int label = CharToInt(buf[pos++]);
+      if (label == ImageHeaders::kGifGraphicControlLabel &&
+          pos + 5 <= buf.size() && CharToInt(buf[pos]) == 4) {
+        disposal = (CharToInt(buf[pos + 1]) >> 2) & 0x07;
+        if (CharToInt(buf[pos + 1]) & 0x01) {  // Transparent colour flag
+          hasGifTransparency_ = true;
+        }
+        delay = LittleEndianIntAtPosition(buf, pos + 2, ImageHeaders::kGifIntSize);
+      } else if (label == ImageHeaders::kGifApplicationLabel &&
+                 pos + 1 + ImageHeaders::kGifNetscapeApplicationLength + 4 <= buf.size() &&
+                 CharToInt(buf[pos]) == ImageHeaders::kGifNetscapeApplicationLength &&
+                 MatchesAtPosition(buf, pos + 1, ImageHeaders::kGifNetscapeApplication,
+                                   ImageHeaders::kGifNetscapeApplicationLength)) {
+        size_t subBlock = pos + 1 + ImageHeaders::kGifNetscapeApplicationLength;
+        if (CharToInt(buf[subBlock]) == 3 &&
+            CharToInt(buf[subBlock + 1]) == 1) {
+          // A repeat count, unlike the play count of APNG and WebP: the
+          // animation plays once more than this, and 0 still means forever.
+          int repeats = LittleEndianIntAtPosition(buf, subBlock + 2, ImageHeaders::kGifIntSize);
+          loopCount_ = (repeats == 0) ? 0 : repeats + 1;
+        }
+      }
+      pos = SkipGifSubBlocks(buf, pos);
+    } else if (id == ImageHeaders::kGifImageSeparator) {
+      if (pos + ImageHeaders::kGifImageDescriptorLength > buf.size()) {
+        break;
+      }
+      packed = CharToInt(buf[pos + ImageHeaders::kGifImageDescriptorLength - 1]);
+      pos += ImageHeaders::kGifImageDescriptorLength;
+      if (packed & ImageHeaders::kGifColorTableFlag) {
+        pos += 3 * (1 << ((packed & 0x07) + 1));  // Local colour table.
+      }
+      pos = SkipGifSubBlocks(buf, pos + 1);  // Skip the LZW minimum code size.
+      numFrames++;
+      duration += delay * 10;  // Delays are in hundredths of a second.
+      if(verbose_) fprintf(stdout, "gif: Frame=%i Delay=%i Disposal=%i\n", numFrames, delay * 10, disposal);
+      delay = 0;
+      disposal = 0;
+    } else {
+      if(verbose_) fprintf(stdout, "gif: unexpected block 0x%02x, stopping\n", id);
+      break;
+    }
+  }
+  if (numFrames <= 0) {
+    fprintf(stderr, "No frames in gif file.\n");
+    return false;
+  }
+  frames_ = numFrames;
+  duration_ = ClampToInt(duration);
+  isAnimated_ = (numFrames > 1);
+  if(verbose_) fprintf(stdout, "gif: Frames=%i\n", frames_);
+  if(verbose_) fprintf(stdout, "gif: Loops=%i\n", loopCount_);
+  if(verbose_) fprintf(stdout, "gif: Duration=%i\n", duration_);
+  return true;
+}
+
 void Image::FindWebpSize() {
-  const uint8* webp = reinterpret_cast<const uint8*>(content_.data());
+  const uint8_t* webp = reinterpret_cast<const uint8_t*>(content_.data());
   const int webp_size = content_.size();
   int width = 0, height = 0;
   if (WebPGetInfo(webp, webp_size, &width, &height) > 0) {
@@ -457,6 +1140,179 @@ void Image::FindWebpSize() {
   }
 }
 
+// Walks the RIFF chunks of an extended (VP8X) webp stream for the animation
+// flag, the ANIM loop count and the ANMF frame durations. Frame payloads are
+// skipped by their chunk size, so nothing is decoded.
+// See also: https://developers.google.com/speed/webp/docs/riff_container
+void Image::FindWebpAnimation() {
+  const std::string& buf = content_;
+  if (buf.size() < ImageHeaders::kWebpHeaderLength + ImageHeaders::kWebpChunkHeaderLength ||
+      !MatchesAtPosition(buf, ImageHeaders::kWebpHeaderLength, "VP8X", 4)) {
+    return;  // Simple (lossy or lossless) webp can't be animated.
+  }
+  size_t pos = ImageHeaders::kWebpHeaderLength;
+  bool animationFlag = false;
+  int numFrames = 0;
+  uint64_t duration = 0;
+  while (pos + ImageHeaders::kWebpChunkHeaderLength <= buf.size()) {
+    uint32_t size = LittleEndianIntAtPosition(buf, pos + 4, 4);
+    size_t data = pos + ImageHeaders::kWebpChunkHeaderLength;
+    if (size > buf.size() - data) {
+      break;  // Truncated chunk.
+    }
+    if (MatchesAtPosition(buf, pos, "VP8X", 4) && size >= ImageHeaders::kWebpVP8XLength) {
+      animationFlag = (buf[data] & ImageHeaders::kWebpAnimationFlag) != 0;
+      if (!animationFlag) break;
+    } else if (MatchesAtPosition(buf, pos, "ANIM", 4) && size >= ImageHeaders::kWebpANIMLength) {
+      loopCount_ = LittleEndianIntAtPosition(buf, data + 4, 2);
+    } else if (MatchesAtPosition(buf, pos, "ANMF", 4) && size >= ImageHeaders::kWebpANMFLength) {
+      duration += LittleEndianIntAtPosition(buf, data + 12, 3);
+      numFrames++;
+    }
+    pos = data + size + (size & 1);  // Chunks are padded to an even size.
+  }
+  if (animationFlag && numFrames > 0) {
+    frames_ = numFrames;
+    duration_ = ClampToInt(duration);
+    isAnimated_ = (numFrames > 1);
+    if(verbose_) fprintf(stdout, "webp: Frames=%i\n", frames_);
+    if(verbose_) fprintf(stdout, "webp: Loops=%i\n", loopCount_);
+    if(verbose_) fprintf(stdout, "webp: Duration=%i\n", duration_);
+  }
+}
+
+// Looks at the codestream SIZ marker segment at |pos| of a JPEG 2000 image
+// to find its dimensions and component bit depth.
+void Image::FindJ2kCodestreamSize(size_t pos) {
+  const std::string& buf = content_;
+  // SOC and SIZ markers, Lsiz, Rsiz, then the reference grid and image offset
+  // (Xsiz, Ysiz, XOsiz, YOsiz), the tile sizes and offsets, Csiz and Ssiz.
+  if (pos + ImageHeaders::kJ2kSsizOffset < buf.size() &&
+      MatchesAtPosition(buf, pos, ImageHeaders::kJ2kCodestreamHeader,
+                        ImageHeaders::kJ2kCodestreamHeaderLength)) {
+    uint32_t xsiz = BigEndianIntAtPosition(buf, pos + ImageHeaders::kJ2kXsizOffset, 4);
+    uint32_t ysiz = BigEndianIntAtPosition(buf, pos + ImageHeaders::kJ2kXsizOffset + 4, 4);
+    uint32_t xosiz = BigEndianIntAtPosition(buf, pos + ImageHeaders::kJ2kXsizOffset + 8, 4);
+    uint32_t yosiz = BigEndianIntAtPosition(buf, pos + ImageHeaders::kJ2kXsizOffset + 12, 4);
+    if (xsiz > xosiz && ysiz > yosiz) {
+      width_ = xsiz - xosiz;
+      height_ = ysiz - yosiz;
+      bitdepth_ = (CharToInt(buf[pos + ImageHeaders::kJ2kSsizOffset]) & 0x7f) + 1;
+    }
+  }
+}
+
+// Looks through the top level boxes of a JP2 file for the image header
+// (ihdr) box inside the JP2 header (jp2h) superbox, falling back to the SIZ
+// segment of a raw JPEG 2000 codestream.
+// See also: ISO/IEC 15444-1 Annex I
+void Image::FindJp2kSize() {
+  const std::string& buf = content_;
+  size_t data, end;
+  if (buf[0] != '\0') {
+    FindJ2kCodestreamSize(0);
+  } else if (FindJp2Box(buf, 0, buf.size(), "jp2h", &data, &end) &&
+             FindJp2Box(buf, data, end, "ihdr", &data, &end) &&
+             end - data >= ImageHeaders::kJp2IhdrLength) {
+    height_ = BigEndianIntAtPosition(buf, data, 4);
+    width_ = BigEndianIntAtPosition(buf, data + 4, 4);
+    int bpc = CharToInt(buf[data + 10]);
+    if (bpc != 0xff) {  // 0xff means the bit depth varies by component.
+      bitdepth_ = (bpc & 0x7f) + 1;
+    }
+  } else if (FindJp2Box(buf, 0, buf.size(), "jp2c", &data, &end)) {
+    FindJ2kCodestreamSize(data);
+  }
+  if ((height_ <= 0) || (width_ <= 0)) {
+    height_ = 0;
+    width_ = 0;
+    fprintf(stderr, "Couldn't find jp2k dimensions (data truncated?).\n");
+  }
+}
+
+// Looks at the first IFD of a JPEG XR file for the ImageWidth and
+// ImageHeight tags. JPEG XR files are always little-endian.
+// See also: ITU-T T.832 Annex A
+void Image::FindJxrSize() {
+  const std::string& buf = content_;
+  uint32_t ifd = LittleEndianIntAtPosition(buf, 4, 4);
+  uint32_t width = 0, height = 0;
+  if (FindIfdValue(buf, 0, buf.size(), ifd, false, ImageHeaders::kJxrImageWidthTag, &width) &&
+      FindIfdValue(buf, 0, buf.size(), ifd, false, ImageHeaders::kJxrImageHeightTag, &height)) {
+    if (width <= ImageHeaders::kMaxDimension && height <= ImageHeaders::kMaxDimension) {
+      width_ = width;
+      height_ = height;
+    }
+  }
+  if ((height_ <= 0) || (width_ <= 0)) {
+    height_ = 0;
+    width_ = 0;
+    fprintf(stderr, "Couldn't find jxr dimensions (data truncated or IFD missing).\n");
+  }
+}
+
+// Looks at the first IFD of a TIFF file for the ImageWidth, ImageLength and
+// BitsPerSample tags.
+// See also: http://partners.adobe.com/public/developer/en/tiff/TIFF6.pdf
+void Image::FindTiffSize() {
+  const std::string& buf = content_;
+  bool bigEndian = (buf[0] == 'M');
+  uint32_t ifd = IntAtPosition(buf, 4, 4, bigEndian);
+  uint32_t width = 0, height = 0, bitdepth = 1;
+  if (FindIfdValue(buf, 0, buf.size(), ifd, bigEndian, ImageHeaders::kTiffImageWidthTag, &width) &&
+      FindIfdValue(buf, 0, buf.size(), ifd, bigEndian, ImageHeaders::kTiffImageLengthTag, &height)) {
+    if (width <= ImageHeaders::kMaxDimension && height <= ImageHeaders::kMaxDimension) {
+      width_ = width;
+      height_ = height;
+    }
+    FindIfdValue(buf, 0, buf.size(), ifd, bigEndian, ImageHeaders::kTiffBitsPerSampleTag, &bitdepth);
+    bitdepth_ = bitdepth;
+  }
+  if ((height_ <= 0) || (width_ <= 0)) {
+    height_ = 0;
+    width_ = 0;
+    fprintf(stderr, "Couldn't find tiff dimensions (data truncated or IFD missing).\n");
+  }
+}
+
+// Looks at the BITMAPINFOHEADER (or the older BITMAPCOREHEADER) following the
+// bmp file header to find image dimensions.
+// See also: http://en.wikipedia.org/wiki/BMP_file_format
+void Image::FindBmpSize() {
+  const std::string& buf = content_;
+  if (buf.size() < ImageHeaders::kBmpInfoHeaderStart + ImageHeaders::kBmpCoreHeaderLength) {
+    fprintf(stderr, "Couldn't find bmp dimensions (data truncated).\n");
+    return;
+  }
+  size_t info = ImageHeaders::kBmpInfoHeaderStart;
+  uint32_t headerSize = LittleEndianIntAtPosition(buf, info, 4);
+  if (headerSize == ImageHeaders::kBmpCoreHeaderLength) {
+    width_ = LittleEndianIntAtPosition(buf, info + 4, 2);
+    height_ = LittleEndianIntAtPosition(buf, info + 6, 2);
+    bitdepth_ = LittleEndianIntAtPosition(buf, info + 10, 2);
+  } else if (headerSize >= ImageHeaders::kBmpInfoHeaderMinLength &&
+             buf.size() >= info + ImageHeaders::kBmpInfoHeaderMinLength) {
+    uint32_t width = LittleEndianIntAtPosition(buf, info + 4, 4);
+    uint32_t height = LittleEndianIntAtPosition(buf, info + 8, 4);
+    // Height is negative (two's complement) for top-down bitmaps; negate it
+    // unsigned so that INT_MIN doesn't overflow, and drop it below.
+    if (height & 0x80000000u) height = 0u - height;
+    if (width <= ImageHeaders::kMaxDimension && height <= ImageHeaders::kMaxDimension) {
+      width_ = width;
+      height_ = height;
+    }
+    bitdepth_ = LittleEndianIntAtPosition(buf, info + 14, 2);
+  } else {
+    fprintf(stderr, "Couldn't find bmp dimensions (unknown header size %u).\n", headerSize);
+    return;
+  }
+  if ((height_ <= 0) || (width_ <= 0)) {
+    height_ = 0;
+    width_ = 0;
+    fprintf(stderr, "Couldn't find bmp dimensions (data truncated?).\n");
+  }
+}
+
 // Looks at image data in order to determine image type, and also fills in any
 // dimension information it can (setting image_type_ and dims_).
 void Image::ComputeImageType() {
@@ -464,83 +1320,32 @@ void Image::ComputeImageType() {
   // but based on well-documented headers (see Wikipedia etc.).
   // Note that we can be fooled if we're passed random binary data;
   // we make the call based on as few as two bytes (JPEG).
-  const StringPiece& buf = content_;
+  const std::string& buf = content_;
   if (verbose_) fprintf(stdout, "buffer.size %ld\n", buf.size());
   if (buf.size() >= 8) {
-    if (verbose_) fprintf(stdout, "buffer[0] %c %d\n", buf[0],  net_instaweb::CharToInt(buf[0]));
-    if (verbose_) fprintf(stdout, "buffer[1] %c %d\n", buf[1],  net_instaweb::CharToInt(buf[1]));
-    if (verbose_) fprintf(stdout, "buffer[2] %c %d\n", buf[2],  net_instaweb::CharToInt(buf[2]));
-    if (verbose_) fprintf(stdout, "buffer[3] %c %d\n", buf[3],  net_instaweb::CharToInt(buf[3]));
-    // Note that gcc rightly complains about constant ranges with the
-    // negative char constants unless we cast.
-    switch (net_instaweb::CharToInt(buf[0])) {
-      case 0x00:
-          //possible jp2k
-          if (net_instaweb::CharToInt(buf[1]) == 0x00
-                  && net_instaweb::CharToInt(buf[2]) == 0x00
-                  && net_instaweb::CharToInt(buf[3]) == 0x0c 
-                  && net_instaweb::CharToInt(buf[4]) == 0x6a 
-                  && net_instaweb::CharToInt(buf[5]) == 0x50
-                  && net_instaweb::CharToInt(buf[6]) == 0x20 
-                  && net_instaweb::CharToInt(buf[7]) == 0x20) {
-              imageFormat_ = IMAGE_FORMAT_JP2K;
-          }
-          break;
-              
-      case 0xff:
-        // Either jpeg or jpeg2
-        // (the latter we don't handle yet, and don't bother looking for).
-        if (net_instaweb::CharToInt(buf[1]) == 0xd8) {
-          imageFormat_ = IMAGE_FORMAT_JPEG;
-          FindJpegSize();
-        }
-        break;
-      case 0x89:
-        // Possible png.
-        if (StringPiece(buf.data(), ImageHeaders::kPngHeaderLength) ==
-            StringPiece(ImageHeaders::kPngHeader,
-                        ImageHeaders::kPngHeaderLength)) {
-          imageFormat_ = IMAGE_FORMAT_PNG;
-          FindPngSize();
-        }
-        break;
-      case 0x49:
-          //possible JXR
-          if (net_instaweb::CharToInt(buf[1]) == 0x49
-                  && net_instaweb::CharToInt(buf[2]) == 0xbc
-                  && net_instaweb::CharToInt(buf[3]) == 0x01) {
-              imageFormat_ = IMAGE_FORMAT_JXR;
-          }
-          break;
-      case 'G':
-        // Possible gif.
-        if ((StringPiece(buf.data(), ImageHeaders::kGifHeaderLength) ==
-             StringPiece(ImageHeaders::kGifHeader,
-                         ImageHeaders::kGifHeaderLength)) &&
-            (buf[ImageHeaders::kGifHeaderLength] == '7' ||
-             buf[ImageHeaders::kGifHeaderLength] == '9') &&
-            buf[ImageHeaders::kGifHeaderLength + 1] == 'a') {
-          imageFormat_ = IMAGE_FORMAT_GIF;
-          FindGifSize();
-        }
-        break;
-      case 'R':
-        // Possible Webp
-        // Detailed explanation on parsing webp format is available at
-        // http://code.google.com/speed/webp/docs/riff_container.html
-        if (buf.size() >= 20 && buf.substr(1, 3) == "IFF" &&
-            buf.substr(8, 4) == "WEBP") {
-          if (buf.substr(12, 4) == "VP8L") {
-            imageFormat_ = IMAGE_FORMAT_WEBP;
-          } else {
-            imageFormat_ = IMAGE_FORMAT_WEBP;
-          }
-          FindWebpSize();
-        }
-        break;
-      default:
+    if (verbose_) fprintf(stdout, "buffer[0] %c %d\n", buf[0],  CharToInt(buf[0]));
+    if (verbose_) fprintf(stdout, "buffer[1] %c %d\n", buf[1],  CharToInt(buf[1]));
+    if (verbose_) fprintf(stdout, "buffer[2] %c %d\n", buf[2],  CharToInt(buf[2]));
+    if (verbose_) fprintf(stdout, "buffer[3] %c %d\n", buf[3],  CharToInt(buf[3]));
+    for (size_t i = 0; i < ImageHeaders::kImageSignatureCount; ++i) {
+      const ImageHeaders::ImageSignature& signature = ImageHeaders::kImageSignatures[i];
+      if (MatchesAtPosition(buf, signature.offset, signature.magic, signature.length) &&
+          (signature.magic2 == NULL ||
+           MatchesAtPosition(buf, signature.offset2, signature.magic2, signature.length2))) {
+        imageFormat_ = signature.format;
         break;
+      }
+    }
+    switch (imageFormat_) {
+      case IMAGE_FORMAT_JPEG: FindJpegSize(); break;
+      case IMAGE_FORMAT_PNG: FindPngSize(); break;
+      case IMAGE_FORMAT_GIF: FindGifSize(); break;
+      case IMAGE_FORMAT_WEBP: FindWebpSize(); break;
+      case IMAGE_FORMAT_JP2K: FindJp2kSize(); break;
+      case IMAGE_FORMAT_JXR: FindJxrSize(); break;
+      case IMAGE_FORMAT_TIFF: FindTiffSize(); break;
+      case IMAGE_FORMAT_BMP: FindBmpSize(); break;
+      default: break;
     }
   }
 }
-
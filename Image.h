@@ -17,18 +17,13 @@
 #ifndef IMAGE_H
 #define	IMAGE_H
 
-#include "pagespeed/kernel/base/string_util.h"
-#include "pagespeed/kernel/image/image_util.h"
+#include <stdint.h>
+#include <string>
 
 extern "C" {
 #include "gif_lib.h"    
 }
 
-#define PNG_DEBUG 3
-#include <png.h>
-
-
-using namespace pagespeed::image_compression;
 
 enum Format {
   IMAGE_FORMAT_UNKNOWN,
@@ -37,7 +32,18 @@ enum Format {
   IMAGE_FORMAT_GIF,
   IMAGE_FORMAT_WEBP,
   IMAGE_FORMAT_JP2K,
-  IMAGE_FORMAT_JXR
+  IMAGE_FORMAT_JXR,
+  IMAGE_FORMAT_TIFF,
+  IMAGE_FORMAT_BMP
+};
+
+// Where the answer to a requested property comes from, cheapest first.
+enum PropertySource {
+  SOURCE_NONE,
+  SOURCE_HEADER,
+  SOURCE_CHUNK,
+  SOURCE_PARTIAL_DECODE,
+  SOURCE_FULL_DECODE
 };
 
 class Image {
@@ -45,15 +51,15 @@ public:
     Image(bool verbose);
     virtual ~Image();
     
-    bool readFile(const GoogleString& file_name);
-    bool analyze(bool checkTransparency, bool checkAnimated, bool checkPhoto, bool checkExtended);
+    bool readFile(const std::string& file_name);
+    bool plan(bool checkTransparency, bool checkAnimated, bool checkPhoto, bool checkExtended);
+    bool analyze();
     bool isPhoto();
     bool isAnimated();
     bool hasTransparency();
     
     Format imageFormat();
     const char * imageFormatAsString();
-    ImageFormat getGoogleImageFormat();
     int height();
     int width();
     int frames();
@@ -61,12 +67,21 @@ public:
     int colortype();
     bool hasGamma();
     double gamma();
+    int loopCount();
+    int duration();
+    int orientation();
+    bool hasIccProfile();
+    bool hasSrgb();
+    int quality();
+    bool isProgressive();
+    const char* subsampling();
+    bool needsPagespeed();
  
     
 private:
     bool verbose_;
-    GoogleString filename_;
-    GoogleString content_;
+    std::string filename_;
+    std::string content_;
     Format imageFormat_;
     bool isPhoto_;
     bool isAnimated_;
@@ -78,16 +93,46 @@ private:
     int colortype_;
     bool hasGamma_;
     double gamma_;
+    int loopCount_;
+    int duration_;
+    int orientation_;
+    bool hasIccProfile_;
+    bool hasSrgb_;
+    int quality_;
+    bool progressive_;
+    const char* subsampling_;
+    bool needsPagespeed_;
+    bool hasTrns_;
+    bool hasGifTransparency_;
+    PropertySource transparencySource_;
+    PropertySource photoSource_;
+    int pngFrames_;
+    uint64_t pngDuration_;
+    size_t pngDataEnd_;
     
     bool  CheckTranparentColorUsed(const GifFileType* gif, int transparentColor);
     
     void ComputeImageType();
+    bool PlanAnimated(PropertySource* source);
+    PropertySource PlanTransparency();
+    PropertySource PlanPhoto();
     void FindJpegSize();
+    void FindJpegFrameDetails(int id, size_t pos);
+    void FindJpegQuality(size_t pos, int length);
     void FindPngSize();
-    bool FindPngDetails();
+    void FindPngMetadata();
+    void FindExifOrientation(size_t tiff, size_t size);
+    void FindPngAnimation();
     void FindGifSize();
     bool FindGifDetails(bool checkTransparency);
+    bool FindGifFrames();
     void FindWebpSize();
+    void FindWebpAnimation();
+    void FindJp2kSize();
+    void FindJ2kCodestreamSize(size_t pos);
+    void FindJxrSize();
+    void FindTiffSize();
+    void FindBmpSize();
     
       
 
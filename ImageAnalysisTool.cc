@@ -16,25 +16,93 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
-//#include <third_party/apr/src/include/apr_time.h>
-//#include <pagespeed/kernel/base/string.h>
-#include "pagespeed/kernel/image/image_util.h"
-#include "pagespeed/kernel/image/image_analysis.h"
-//#include "pagespeed/kernel/image/test_utils.h"
-#include "pagespeed/kernel/base/stdio_file_system.h"
-#include "pagespeed/kernel/base/message_handler.h"
-#include "pagespeed/kernel/base/mock_message_handler.h"
-#include "pagespeed/kernel/base/null_mutex.h"
-#include "pagespeed/kernel/base/string_util.h"
-#include "pagespeed/kernel/base/string_writer.h"
+#include <string>
 
 #include "ImageAnalysisToolConfig.h"
 #include "Image.h"
 #include <getopt.h>
+#ifdef IMGAT_SLIM
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
 
 const char* program_name;
 
+#ifdef IMGAT_SLIM
+/* The slim build has no pagespeed linked in. While the image is planned its
+   output is held in temporary files: when the plan needs the pagespeed
+   analysis the whole command is handed over to the full build, which then
+   reports everything itself, otherwise the held output is replayed.  */
+struct HeldOutput {
+    FILE* stream;
+    int saved;
+    FILE* file;
+};
+
+void release_output (HeldOutput* held)
+{
+    fflush (held->stream);
+    dup2 (held->saved, fileno (held->stream));
+    close (held->saved);
+}
+
+bool hold_output (HeldOutput held[2])
+{
+    FILE* streams[2] = { stdout, stderr };
+    for (int i = 0; i < 2; ++i) {
+        held[i].stream = streams[i];
+        fflush (held[i].stream);
+        held[i].file = tmpfile ();
+        held[i].saved = held[i].file ? dup (fileno (held[i].stream)) : -1;
+        if (held[i].saved < 0 || dup2 (fileno (held[i].file), fileno (held[i].stream)) < 0) {
+            if (held[i].saved >= 0) close (held[i].saved);
+            if (held[i].file) fclose (held[i].file);
+            if (i > 0) {
+                release_output (&held[0]);
+                fclose (held[0].file);
+            }
+            return false;
+        }
+        /* Neither is inherited by the full build.  */
+        fcntl (held[i].saved, F_SETFD, FD_CLOEXEC);
+        fcntl (fileno (held[i].file), F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+}
+
+void replay_output (HeldOutput* held)
+{
+    char buffer[4096];
+    size_t length;
+    rewind (held->file);
+    while ((length = fread (buffer, 1, sizeof (buffer), held->file)) > 0) {
+        fwrite (buffer, 1, length, held->stream);
+    }
+    fclose (held->file);
+}
+
+/* Runs the full imgat with the same command line, looked for next to this
+   binary first and then on the PATH. Only returns if neither could be run.  */
+void exec_full_build (char* argv[])
+{
+    fflush (stdout);
+    char path[PATH_MAX];
+    ssize_t length = readlink ("/proc/self/exe", path, sizeof (path) - 1);
+    if (length > 0) {
+        path[length] = '\0';
+        char* slash = strrchr (path, '/');
+        if (slash && (slash - path) + sizeof (ImageAnalysisTool_FULL_BUILD) < sizeof (path)) {
+            strcpy (slash + 1, ImageAnalysisTool_FULL_BUILD);
+            execv (path, argv);
+        }
+    }
+    execvp (ImageAnalysisTool_FULL_BUILD, argv);
+}
+#endif
+
 void print_usage (FILE* stream, int exit_code)
 {
     fprintf (stream, "Version: Image Analysis Tool %i.%i https://github.com/shawnbissell/image-analysis-tool\n", 
@@ -45,8 +113,10 @@ void print_usage (FILE* stream, int exit_code)
             "  -h  --help             Display this usage information.\n"
             "  -p  --photo            Check if the image is a photo.\n"
             "  -t  --transparency     Check if the image usage transparency.\n"
-            "  -a  --animated         Check if the image is animated.\n"
-            "  -e  --extended         Output extended PNG information (bit-depth, color-type, gamma).\n"
+            "  -a  --animated         Check if the image is animated (GIF, APNG, WebP).\n"
+            "  -e  --extended         Output extended information (PNG bit-depth, color-type, gamma, sRGB;\n"
+            "                         PNG and JPEG EXIF orientation, ICC profile;\n"
+            "                         JPEG quality, subsampling, progressive).\n"
             "  -A  --All              Check all available options.\n"
             "  -v  --verbose          Print verbose messages.\n");
     exit (exit_code);
@@ -123,6 +193,12 @@ int main(int argc, char *argv[]) {
         }
     }
     while (next_option != -1);
+
+#ifdef IMGAT_SLIM
+    /* Only the photo and transparency checks can need pagespeed.  */
+    HeldOutput held[2];
+    bool holding = optind < argc && (checkPhoto || checkTransparency) && hold_output(held);
+#endif
     
     if (verbose) {
         int i;
@@ -132,18 +208,33 @@ int main(int argc, char *argv[]) {
     
     if(optind < argc) {
         
-        GoogleString imageString;
-        imageString.clear();
-        GoogleString fileName;
+        std::string fileName;
         fileName.append(argv[optind]);
 
         Image image(verbose);
-        if(!image.readFile(fileName)){
+        bool read = image.readFile(fileName);
+        bool planned = read && image.plan(checkTransparency, checkAnimated, checkPhoto, checkExtended);
+#ifdef IMGAT_SLIM
+        if(holding) {
+            release_output(&held[0]);
+            release_output(&held[1]);
+        }
+        if(planned && image.needsPagespeed()) {
+            exec_full_build(argv);
+        }
+        /* Only reached if there is no hand over or it failed, in which case
+           the held output shows why.  */
+        if(holding) {
+            replay_output(&held[0]);
+            replay_output(&held[1]);
+        }
+#endif
+        if(!read){
             fprintf(stderr, "Could not read image\n");
             return 66;
         }
 
-        if(image.analyze(checkTransparency, checkAnimated, checkPhoto, checkExtended)) {
+        if(planned && image.analyze()) {
             fprintf(stdout, "format=%s\n",  image.imageFormatAsString());
             fprintf(stdout, "width=%i\nheight=%i\n", image.width(), image.height());
             if(checkPhoto) fprintf(stdout, "photo=%i\n", image.isPhoto()); 
@@ -151,14 +242,32 @@ int main(int argc, char *argv[]) {
             if(checkAnimated) {
                 fprintf(stdout, "animated=%i\n", image.isAnimated());  
                 fprintf(stdout, "frames=%i\n", image.frames()); 
+                fprintf(stdout, "loops=%i\n", image.loopCount());
+                fprintf(stdout, "duration=%i\n", image.duration());
             }
             if(checkExtended && image.imageFormat() == IMAGE_FORMAT_PNG) {
                 fprintf(stdout, "bitdepth=%i\n", image.bitdepth());
                 fprintf(stdout, "colortype=%i\n", image.colortype());
                 fprintf(stdout, "hasGamma=%i\n", image.hasGamma());
                 fprintf(stdout, "gamma=%f\n", image.gamma());
+                fprintf(stdout, "hasSrgb=%i\n", image.hasSrgb());
+            }
+            if(checkExtended && (image.imageFormat() == IMAGE_FORMAT_PNG
+                    || image.imageFormat() == IMAGE_FORMAT_JPEG)) {
+                fprintf(stdout, "orientation=%i\n", image.orientation());
+                fprintf(stdout, "hasIccProfile=%i\n", image.hasIccProfile());
+            }
+            if(checkExtended && image.imageFormat() == IMAGE_FORMAT_JPEG) {
+                fprintf(stdout, "quality=%i\n", image.quality());
+                fprintf(stdout, "subsampling=%s\n", image.subsampling());
+                fprintf(stdout, "progressive=%i\n", image.isProgressive());
             }
         } else {
+#ifdef IMGAT_SLIM
+            if(image.needsPagespeed()) {
+                fprintf(stderr, "Could not run %s for the pagespeed analysis.\n", ImageAnalysisTool_FULL_BUILD);
+            }
+#endif
             fprintf(stderr, "Could not analyze image.\n");
             return 65;
         }
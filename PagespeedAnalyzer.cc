@@ -0,0 +1,48 @@
+/*
+ * Copyright 2014-2015 Shawn Bissell 
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PagespeedAnalyzer.h"
+
+#include "pagespeed/kernel/image/image_util.h"
+#include "pagespeed/kernel/image/image_analysis.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/mock_message_handler.h"
+#include "pagespeed/kernel/base/null_mutex.h"
+
+using namespace pagespeed::image_compression;
+
+static ImageFormat GetGoogleImageFormat(Format format)
+{
+    switch(format)
+    {
+        case IMAGE_FORMAT_JPEG: return IMAGE_JPEG;
+        case IMAGE_FORMAT_GIF: return IMAGE_GIF;
+        case IMAGE_FORMAT_PNG: return IMAGE_PNG;
+        case IMAGE_FORMAT_WEBP: return IMAGE_WEBP;
+        default: return IMAGE_UNKNOWN;
+    }
+}
+
+bool PagespeedAnalyzeImage(Format format, const std::string& content,
+                           bool* hasTransparency, bool* isPhoto) {
+    ImageFormat googleFormat = GetGoogleImageFormat(format);
+    if(googleFormat == IMAGE_UNKNOWN) {
+        return false;
+    }
+    net_instaweb::MockMessageHandler messageHandler(new net_instaweb::NullMutex);
+    return AnalyzeImage(googleFormat, content.data(), content.length(),
+                        &messageHandler, hasTransparency, isPhoto);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright 2014-2015 Shawn Bissell 
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEEDANALYZER_H
+#define	PAGESPEEDANALYZER_H
+
+#include <string>
+
+#include "Image.h"
+
+// Runs the pagespeed image analysis, which decodes the whole image, to find
+// out if it uses transparency and if it is a photo. This is the only code
+// that links against pagespeed, it is left out of the imgat-slim build.
+bool PagespeedAnalyzeImage(Format format, const std::string& content,
+                           bool* hasTransparency, bool* isPhoto);
+
+#endif	/* PAGESPEEDANALYZER_H */
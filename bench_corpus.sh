@@ -0,0 +1,54 @@
+#!/bin/sh
+# Runs imgat over every file in a corpus directory and reports how many files
+# went through the libgif partial decode and the pagespeed full decode, and
+# the mean wall time per file.
+#
+#   ./bench_corpus.sh imgat corpus_dir [imgat options]
+#
+# The options default to -t. The decodes are counted from the verbose output,
+# which every imgat version prints, so builds from different revisions can be
+# compared on the same corpus.
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 imgat corpus_dir [imgat options]" >&2
+    exit 64
+fi
+binary=$1
+corpus=$2
+shift 2
+[ $# -eq 0 ] && set -- -t
+
+if [ ! -x "$binary" ]; then
+    echo "$0: $binary not found" >&2
+    exit 66
+fi
+
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+files=0
+libgif=0
+pagespeed=0
+failed=0
+elapsed=0
+for image in "$corpus"/*; do
+    [ -f "$image" ] || continue
+    start=$(now_us)
+    output=$("$binary" -v "$@" "$image" 2> /dev/null) || failed=$((failed + 1))
+    end=$(now_us)
+    elapsed=$((elapsed + end - start))
+    files=$((files + 1))
+    case $output in *"libgif: analyzing gif image"*) libgif=$((libgif + 1)) ;; esac
+    case $output in *"pagespeed: analyzing image"*) pagespeed=$((pagespeed + 1)) ;; esac
+done
+
+if [ $files -eq 0 ]; then
+    echo "$0: no files in $corpus" >&2
+    exit 66
+fi
+echo "files=$files"
+echo "failed=$failed"
+echo "libgif=$libgif"
+echo "pagespeed=$pagespeed"
+echo "$elapsed $files" | awk '{ printf "mean_ms=%.3f\n", $1 / 1000 / $2 }'
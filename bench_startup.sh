@@ -0,0 +1,67 @@
+#!/bin/sh
+# Compares the start-up cost of imgat and imgat-slim on one image.
+#
+#   ./bench_startup.sh [-n runs] [-c] build_dir image [imgat options]
+#
+# For each build prints the mean wall time of <runs> invocations (default 100)
+# and the peak RSS of one invocation, as reported by /usr/bin/time. With -c
+# the page cache is dropped before the first, cold, invocation of each build,
+# which needs root. The options default to -a, which the slim build answers
+# without handing over to imgat. Set GNU_TIME if GNU time isn't /usr/bin/time.
+
+runs=100
+cold=0
+while getopts "n:c" opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        c) cold=1 ;;
+        *) echo "Usage: $0 [-n runs] [-c] build_dir image [imgat options]" >&2; exit 64 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 [-n runs] [-c] build_dir image [imgat options]" >&2
+    exit 64
+fi
+build_dir=$1
+image=$2
+shift 2
+[ $# -eq 0 ] && set -- -a
+
+gnu_time=${GNU_TIME:-/usr/bin/time}
+if [ ! -x "$gnu_time" ]; then
+    echo "$0: $gnu_time (GNU time) is required" >&2
+    exit 69
+fi
+
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+printf "%-12s %10s %12s %10s\n" build cold_ms mean_ms rss_kb
+for build in imgat imgat-slim; do
+    binary=$build_dir/$build
+    if [ ! -x "$binary" ]; then
+        echo "$0: $binary not found" >&2
+        exit 66
+    fi
+    cold_ms=-
+    if [ $cold -eq 1 ]; then
+        sync && echo 3 > /proc/sys/vm/drop_caches || exit 77
+        start=$(now_us)
+        "$binary" "$@" "$image" > /dev/null 2>&1
+        end=$(now_us)
+        cold_ms=$(echo "$start $end" | awk '{ printf "%.3f", ($2 - $1) / 1000 }')
+    fi
+    "$binary" "$@" "$image" > /dev/null 2>&1  # Warm the page cache.
+    start=$(now_us)
+    i=0
+    while [ $i -lt "$runs" ]; do
+        "$binary" "$@" "$image" > /dev/null 2>&1
+        i=$((i + 1))
+    done
+    end=$(now_us)
+    mean_ms=$(echo "$start $end $runs" | awk '{ printf "%.3f", ($2 - $1) / 1000 / $3 }')
+    rss_kb=$("$gnu_time" -f "%M" "$binary" "$@" "$image" 2>&1 > /dev/null | tail -n 1)
+    printf "%-12s %10s %12s %10s\n" "$build" "$cold_ms" "$mean_ms" "$rss_kb"
+done